@@ -40,19 +40,40 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
 #include <util/delay.h>
 
 #define FLASH_POWER 8000      // power level at which the firefly flashes
 #define POWER_BOOST 400       // amount of power to add, for every other flash
-#define FLASH_DELAY 200       // how long lasts the flash
-#define DAYLIGHT 240          // values higher than that are recognized as daylight
-#define DAYLIGHT_DELAY 10000  // wait 10 seconds, if daylight detected
+#define FLASH_DELAY 400       // how long lasts the flash, in cycles (0.2 s)
+#define CYCLE_ROUNDS 19       // timer 0 rounds per cycle, 19 * 256 clocks = 0.507 ms
+                              // FREE_PERIOD is 1.98 s now, older firmware ran ~2.5 s,
+                              // so they can't sync with each other, flash all of them
+#define DAYLIGHT_ENTER 240    // values higher than that are recognized as daylight
+#define DAYLIGHT_EXIT 200     // values lower than that are recognized as darkness again
+#define DAWN_CONFIRM 20000    // cycles (10 s) of daylight, before we go to standby
+#define DUSK_CONFIRM 10       // wakeups (10 s) of darkness, before we start again
+#define DAYLIGHT_INDICATOR 1000  // show green for 1 second, when we go to standby
 #define BLIND_AFTER_OTHER 800 // how long are we blind after another flash
 #define BLIND_AFTER_SELF 100  // how long are we blind after our own flash
 #define THRESHOLD_DELTA 20    // added to the ambient light value
+#define AMBIENT_SHIFT 4       // the ambient light is kept as 16 times its average
+#define RAMP_CYCLES 3497      // cycles from power 0 to FLASH_POWER, without any boost
+#define FREE_PERIOD (RAMP_CYCLES + FLASH_DELAY)  // our period, if nobody boosts us
+#define OSCCAL_RANGE 8        // max steps we trim OSCCAL away from the factory value
+#define OSCCAL_MAX 127        // OSCCAL is 7 bits only
+#define OSCCAL_WINDOW 400     // neighbour intervals further off FREE_PERIOD are ignored
+#define OSCCAL_HYST 30        // dead band around FREE_PERIOD, no trimming inside
+#define OSCCAL_VOTES 4        // consecutive votes needed for a single trim step
+
+#define STATE_NIGHT 0         // dark, we are flashing
+#define STATE_DAWN 1          // bright, but not for long enough, still flashing
+#define STATE_DAY 2           // bright, we are in standby
+#define STATE_DUSK 3          // dark, but not for long enough, still in standby
 
 
 // #define NEW_RGB // use this to choose different leds pins
+// #define BALANCED_PWM // use this for the cycle balanced PWM interrupt (unverified)
 
 #ifdef NEW_RGB
 #define B_BIT 0               // pin 5  -- LED pin 2
@@ -64,15 +85,20 @@
 #define G_BIT 2               // pin 7  -- LED pin 1
 #endif
 
+#define PWM_PINS ((1 << R_BIT) | (1 << G_BIT) | (1 << B_BIT))
+
 
 static volatile uint8_t act_light = 0;  // value for lightness
-static uint8_t softscale = 0; // used to prescale the timer 
+static volatile uint8_t rounds = 0;     // timer 0 rounds, not yet taken by wait_cycles()
+static volatile uint8_t softscale = 0; // used to prescale the timer 
 static volatile uint8_t r = 0;         // rgb, set these to control the color
 static volatile uint8_t g = 0;         // green
 static volatile uint8_t b = 0;         // blue
 static uint8_t rtmp = 0;      // tmp vars for rgb, do not use directly
 static uint8_t gtmp = 0;      
 static uint8_t btmp = 0;      
+static uint8_t osccal_factory = 0;  // factory calibration, read at startup
+static int8_t osccal_votes = 0;     // > 0: we are too slow, < 0: we are too fast
 
 
 
@@ -87,6 +113,27 @@ SIGNAL(ADC_vect) {
 
 
 
+/* -----------------------------------------------------
+ * Watchdog interrupt
+ * Only used to wake up from standby.
+ */
+EMPTY_INTERRUPT(WDT_vect);
+
+
+
+/* -----------------------------------------------------
+ * Timer0 compare match interrupt
+ * Once every round of timer 0 (OCR0A is 0), counts the rounds
+ * for wait_cycles() and wakes it up from idle sleep.
+ */
+SIGNAL(TIM0_COMPA_vect) {
+  if (rounds < 255) {
+    rounds++;
+  }
+}
+
+
+
 /* -----------------------------------------------------
  * Timer0 overflow interrupt
  * F_CPU 9.600.000 Hz 
@@ -96,13 +143,109 @@ SIGNAL(ADC_vect) {
  * Read global rgb and save it to tmp vars and decide, to switch
  * on R, G or B. 
  * Range is for rgb is 0-255 (dark to full power)
+ *
+ * The LEDs are dark most of the time, so if all colors are 0
+ * the interrupt switches itself off, with all pins low. After
+ * setting a new color, call pwm_resume() to start it again.
+ *
+ * With BALANCED_PWM every path through the interrupt is meant
+ * to take the same time. It is written in assembler, because the
+ * compiler gives no such guarantee. There are no branches, a
+ * pin is on while softscale < tmp (one compare and a rotate per
+ * color) and the values are taken over at softscale == 0 with
+ * cpse + mov, which takes 2 cycles whether it skips or not.
+ * Counted by hand from the instructions below: 91 cycles per
+ * overflow, including the interrupt response, the rjmp in the
+ * vector table and reti. That is more than the C version, and
+ * the length of the main loop cycles doesn't depend on it (see
+ * wait_cycles()). It is off by default, until the count has
+ * been checked with avr-objdump -d or simavr.
  */
+#ifdef BALANCED_PWM
+
+// load the new value at step 0, keep the old one otherwise, then
+// collect the color for parking and rotate "step < tmp" into the pins
+#define PWM_COLOR(color, tmp) \
+    "lds r26, " color "\n\t" \
+    "lds r25, " tmp "\n\t" \
+    "cpse r24, r27\n\t" \
+    "mov r26, r25\n\t" \
+    "sts " tmp ", r26\n\t" \
+    "or r31, r26\n\t" \
+    "cp r24, r26\n\t" \
+    "rol r30\n\t"
+
+ISR(TIM0_OVF_vect, ISR_NAKED) {
+  __asm__ __volatile__ (
+    "push r24\n\t"
+    "in r24, __SREG__\n\t"
+    "push r24\n\t"
+    "push r25\n\t"
+    "push r26\n\t"
+    "push r27\n\t"
+    "push r30\n\t"
+    "push r31\n\t"
+    "clr r27\n\t"                // our own zero, r1 may be in use
+    "clr r30\n\t"                // pins to switch on
+    "clr r31\n\t"                // all colors or'ed together
+    "lds r24, %[step]\n\t"       // ++softscale
+    "inc r24\n\t"
+    "sts %[step], r24\n\t"
+    // pin bit 2 first, it gets rotated to the top
+    PWM_COLOR("%[n2]", "%[t2]")
+    PWM_COLOR("%[n1]", "%[t1]")
+    PWM_COLOR("%[n0]", "%[t0]")
+    "in r25, %[port]\n\t"        // switch the pins
+    "andi r25, %[clear]\n\t"
+    "or r25, r30\n\t"
+    "out %[port], r25\n\t"
+    "or r31, r24\n\t"            // zero only at step 0 with all colors dark
+    "in r25, %[timsk]\n\t"
+    "andi r25, %[stop]\n\t"
+    "cpse r31, r27\n\t"
+    "ori r25, %[run]\n\t"
+    "out %[timsk], r25\n\t"      // park, if all dark
+    "pop r31\n\t"
+    "pop r30\n\t"
+    "pop r27\n\t"
+    "pop r26\n\t"
+    "pop r25\n\t"
+    "pop r24\n\t"
+    "out __SREG__, r24\n\t"
+    "pop r24\n\t"
+    "reti\n\t"
+    :
+    : [step] "i" (&softscale),
+      [n2] "i" (&g), [t2] "i" (&gtmp),
+#ifdef NEW_RGB
+      [n1] "i" (&r), [t1] "i" (&rtmp),
+      [n0] "i" (&b), [t0] "i" (&btmp),
+#else
+      [n1] "i" (&b), [t1] "i" (&btmp),
+      [n0] "i" (&r), [t0] "i" (&rtmp),
+#endif
+      [port] "I" (_SFR_IO_ADDR(PORTB)),
+      [clear] "M" ((uint8_t) ~PWM_PINS),
+      [timsk] "I" (_SFR_IO_ADDR(TIMSK0)),
+      [stop] "M" ((uint8_t) ~(1 << TOIE0)),
+      [run] "M" (1 << TOIE0)
+  );
+}
+
+#else
+
 SIGNAL(TIM0_OVF_vect) {	
+  uint8_t step = ++softscale;
   // every 256th step take over new values
-  if (++softscale == 0) {    
+  if (step == 0) {    
     rtmp = r;
     gtmp = g;
     btmp = b;
+    if (!(rtmp | gtmp | btmp)) {  // all dark, park the pins and stop
+      PORTB &= ~PWM_PINS;
+      TIMSK0 &= ~(1 << TOIE0);
+      return;
+    }
     // check if switch on r, g and b
     if (rtmp > 0) {        
       PORTB |= (1 << R_BIT);
@@ -115,17 +258,34 @@ SIGNAL(TIM0_OVF_vect) {
     } 
   }
   // check if switch off r, g and b
-  if (softscale == rtmp) {     
+  if (step == rtmp) {     
     PORTB &= ~(1 << R_BIT);
   }
-  if (softscale == gtmp) {
+  if (step == gtmp) {
     PORTB &= ~(1 << G_BIT);
   }
-  if (softscale == btmp) {
+  if (step == btmp) {
     PORTB &= ~(1 << B_BIT);
   }
 }
 
+#endif
+
+
+
+/* -----------------------------------------------------
+ * Starts the PWM again, after it parked itself. The next
+ * overflow begins a fresh PWM cycle with the new color, so
+ * there is no glitch. Call this after setting r, g or b.
+ */
+void pwm_resume(void) {
+  if (!(TIMSK0 & (1 << TOIE0))) {
+    softscale = 255;
+    TIFR0 = (1 << TOV0);            // clear the stale overflow, wait for a real one
+    TIMSK0 |= (1 << TOIE0);
+  }
+}
+
 
 
 /* -----------------------------------------------------
@@ -201,6 +361,139 @@ void h_to_rgb(uint8_t hue) {
     b = 252-fs;  //  blue: ramp down
     break;
   }
+  pwm_resume();
+}
+
+
+
+/* -----------------------------------------------------
+ * Trims the internal RC oscillator. The factory calibration
+ * of the 9.6 MHz RC oscillator leaves some percent of spread,
+ * so every firefly runs at a slightly different speed and the
+ * swarm drifts apart between flashes.
+ *
+ * interval is the time between two flashes of our neighbours,
+ * counted in our own main loop cycles. It is compared with
+ * FREE_PERIOD, the period we would have without being boosted.
+ * Our measured period can't be used, it includes the boosts we
+ * got from the neighbours and follows their interval as soon as
+ * we are in sync. If the neighbours flash more often than we
+ * would, our clock is too slow and OSCCAL gets increased, and
+ * vice versa. Intervals far off (missed flashes, flashes of
+ * different neighbours) are ignored.
+ * Only after OSCCAL_VOTES consecutive votes in the same direction
+ * OSCCAL is moved by a single step, never further than
+ * OSCCAL_RANGE steps away from the factory value and never out
+ * of 0..OSCCAL_MAX.
+ */
+void trim_osccal(uint16_t interval) {
+  if ((interval + OSCCAL_WINDOW < FREE_PERIOD) || (interval > FREE_PERIOD + OSCCAL_WINDOW)) {
+    return;
+  }
+  if (interval + OSCCAL_HYST < FREE_PERIOD) {     // neighbours are faster
+    if (osccal_votes < 0) {
+      osccal_votes = 0;
+    }
+    if (++osccal_votes >= OSCCAL_VOTES) {
+      osccal_votes = 0;
+      if ((OSCCAL < osccal_factory + OSCCAL_RANGE) && (OSCCAL < OSCCAL_MAX)) {
+        OSCCAL++;
+      }
+    }
+  }
+  else if (interval > FREE_PERIOD + OSCCAL_HYST) {  // neighbours are slower
+    if (osccal_votes > 0) {
+      osccal_votes = 0;
+    }
+    if (--osccal_votes <= -OSCCAL_VOTES) {
+      osccal_votes = 0;
+      if ((OSCCAL > osccal_factory - OSCCAL_RANGE) && (OSCCAL > 0)) {
+        OSCCAL--;
+      }
+    }
+  }
+  else {                                          // close enough, keep it
+    osccal_votes = 0;
+  }
+}
+
+
+
+/* -----------------------------------------------------
+ * Waits for the given number of main loop cycles. A cycle is
+ * CYCLE_ROUNDS rounds of timer 0, so it is always exactly
+ * 19 * 256 = 4864 clocks long, no matter how much time the work
+ * in the main loop, the ADC or the PWM interrupt took, as long as
+ * the work stays below one cycle. The rounds are counted by the
+ * compare match interrupt, the overflow belongs to the PWM. Only
+ * the rounds of a cycle are taken from the counter, so a cycle
+ * that started late is not lost.
+ *
+ * We sleep in idle mode between the interrupts. Timer 0 and the
+ * ADC keep running, but the CPU is stopped, so the time the
+ * parked PWM interrupt doesn't need anymore saves current.
+ * Interrupts are only enabled right before sleep_cpu(), so a
+ * compare match can't slip in between the check and the sleep.
+ *
+ * This makes the firefly easy to model: the power ramp, blind
+ * and the flash are all counted in cycles of the same, constant
+ * length, whether the LED is on or off.
+ */
+void wait_cycles(uint16_t n) {
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  while (n--) {
+    cli();
+    while (rounds < CYCLE_ROUNDS) {
+      sleep_enable();
+      sei();                        // the next instruction is executed first
+      sleep_cpu();
+      sleep_disable();
+      cli();
+    }
+    rounds -= CYCLE_ROUNDS;
+    sei();
+  }
+}
+
+
+
+/* -----------------------------------------------------
+ * Measures the ambient light, to start the running average
+ * the flash threshold is derived from. Returns 16 times the
+ * average of 4 samples (see AMBIENT_SHIFT). Takes 2 seconds.
+ */
+uint16_t measure_ambient(void) {
+  uint8_t i;
+  uint16_t ambient = 0;
+  for (i = 0; i < 4; i++) {
+    ambient += act_light;
+    _delay_ms(500);
+  }	
+  return ambient << 2;              // 4 samples, times 4 gives 16 times the average
+}
+
+
+
+/* -----------------------------------------------------
+ * Standby during the day. Switches off the LEDs, the ADC and
+ * the voltage divider of the photo transistor and powers down
+ * until the watchdog wakes us up about 1 second later. Then
+ * everything is switched on again and the lightness is returned.
+ * The PWM has to be parked first, otherwise its interrupt could
+ * switch a pin on again, so we wait until it has parked itself.
+ */
+uint8_t standby(void) {
+  while (TIMSK0 & (1 << TOIE0));    // wait until the PWM has parked itself
+  ADCSRA &= ~(1 << ADEN);           // switch off the ADC
+  PORTB &= ~((1 << PB3) | PWM_PINS);
+  WDTCR = (1 << WDTIE) | (1 << WDP2) | (1 << WDP1);  // watchdog interrupt in 1 s
+  set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+  sleep_mode();
+  WDTCR = 0;                        // stop the watchdog
+  PORTB |= (1 << PB3);              // power on the voltage divider
+  ADCSRA |= (1 << ADEN) | (1 << ADSC);  // and restart the conversions
+  _delay_ms(10);                    // wait for some fresh samples
+  return act_light;
 }
 
 
@@ -211,9 +504,17 @@ int main(void) {
   uint8_t light = 0;          // current lightness
   uint8_t nervous = 0;        // value for how nervous we are. 0 to 168. 
   uint16_t threshold = 0;     // threshold to determine a flash
+  uint16_t ambient = 0;       // running average of the ambient light, times 16
+  uint8_t sample = 0;         // the ambient is only sampled every 256th cycle
   uint16_t power = 0;         // current power level
   uint16_t blind = 0;         // stores for how many cycles we are blind
   uint16_t flash_power = FLASH_POWER;  // if power is > flash_power, then flash
+  uint16_t since_other = 0xffff;  // cycles since the last flash of the others
+  uint8_t state = STATE_NIGHT;  // day, dusk, night or dawn
+  uint16_t confirm = 0;       // how long the current dawn or dusk lasts
+
+  // remember the factory calibration, we only trim around it
+  osccal_factory = OSCCAL;
 	
   // enable pins as output
   DDRB |= 
@@ -228,8 +529,11 @@ int main(void) {
   // timer 0 setup, prescaler none
   TCCR0B |= (0 << CS02) | (0 << CS01) | (1 << CS00);
 
-  // enable timer 0 interrupt
-  TIMSK0 |= (1 << TOIE0);	
+  // compare match once every round, at 0, wait_cycles() counts these
+  OCR0A = 0;
+
+  // enable timer 0 interrupts, overflow for the PWM, compare match for the cycles
+  TIMSK0 |= (1 << TOIE0) | (1 << OCIE0A);	
 
   // enable adc
   ADCSRA |= 
@@ -251,6 +555,7 @@ int main(void) {
   // intro, blink red 5 times
   for (i = 0; i < 5; i++) {
     r = 255;
+    pwm_resume();
     _delay_ms(100);
     r = 0;
     _delay_ms(100);
@@ -258,12 +563,8 @@ int main(void) {
 
 
   // compute threshold of the ambient light
-  for (i = 0; i < 4; i++) {
-    threshold += act_light;
-    _delay_ms(500);
-  }	
-  threshold = threshold >> 2;       // divides by 4
-  threshold += THRESHOLD_DELTA;     // move the threshold above the ambient average
+  ambient = measure_ambient();
+  threshold = (ambient >> AMBIENT_SHIFT) + THRESHOLD_DELTA;
 
   // try to sleep some randomized time
   i = (act_light & 0x03);           // use the last (right most) 2 bits of the actual lightness
@@ -274,7 +575,27 @@ int main(void) {
   // enter the main loop
   while (1) {
 
-    _delay_us(500);                 // every cylce takes at least 0.5 ms
+    if (state >= STATE_DAY) {       // during the day we sleep most of the time
+      light = standby();
+      if (light >= DAYLIGHT_EXIT) { // still bright
+        state = STATE_DAY;
+      }
+      else if (state == STATE_DAY) {  // getting dark, wait if it lasts
+        state = STATE_DUSK;
+        confirm = 1;                // this was the first dark wakeup
+      }
+      else if (++confirm >= DUSK_CONFIRM) {  // it's night, start again
+        ambient = measure_ambient();  // still some twilight, the average follows it down
+        threshold = (ambient >> AMBIENT_SHIFT) + THRESHOLD_DELTA;
+        state = STATE_NIGHT;
+      }
+      continue;
+    }
+
+    wait_cycles(1);                 // every cylce takes exactly 0.507 ms
+    if (since_other < 0xffff) {
+      since_other++;
+    }
 
     if (power > 6000) {             // increase the power level with a, first fast ascending,
       power += 1;                   // later slower ascending, function
@@ -293,13 +614,17 @@ int main(void) {
     }
 
     light = act_light;              // read the actual lightness
-    if (!blind) {                   
-      if (light > DAYLIGHT) {	    // if we detect daylight, then it's too bright to work
-	g = 32;                     // switch color to green
-        _delay_ms(DAYLIGHT_DELAY);  // and wait 10 seconds
-	g = 0;                      
+    if (blind) {                    // if we are blind, then do nothing
+      blind--;
+    }
+    else if (state == STATE_NIGHT) {
+      if (light <= threshold) {     // no flash, follow the ambient light slowly (~2 s)
+        if (++sample == 0) {
+          ambient = ambient - (ambient >> AMBIENT_SHIFT) + light;
+          threshold = (ambient >> AMBIENT_SHIFT) + THRESHOLD_DELTA;
+        }
       }
-      else if (light > threshold) { // was it a flash?
+      else {                        // it was a flash
 	// if the flash comes in, when we are in between 2000 and 7000, then we detect
 	// the flash as not in sync and increase the nervous level ...
 	if ((power > 2000) && (power < 7000)) {
@@ -312,19 +637,42 @@ int main(void) {
 	}
         power += POWER_BOOST;       // boost the power
         blind = BLIND_AFTER_OTHER;  // and we are blind for the next cycles
+        trim_osccal(since_other);   // compare their period with ours
+        since_other = 0;
       }
     }
-    else if (blind > 0) {           // if we are blind, then do nothing
-      blind--;							
+
+    // Daylight has to last for a while, before we go to standby. Shorter
+    // transients (clouds, cars, a bright neighbour) keep our power level,
+    // so we don't lose the sync with the swarm.
+    if (state == STATE_NIGHT) {
+      if (light > DAYLIGHT_ENTER) { // too bright to detect any flashes
+        state = STATE_DAWN;
+        confirm = 0;
+      }
+    }
+    else if (light < DAYLIGHT_EXIT) {  // only a transient, back to work
+      state = STATE_NIGHT;
+    }
+    else if (++confirm >= DAWN_CONFIRM) {  // it's day, go to standby
+      g = 32;                       // switch color to green
+      pwm_resume();
+      _delay_ms(DAYLIGHT_INDICATOR);
+      g = 0;
+      since_other = 0xffff;         // our interval is meaningless now
+      state = STATE_DAY;
     }
 						
     if (power > flash_power) {      // if there is enough power, then we flash
       h_to_rgb(168 - nervous);      // display the color, depending on the nervous level
-      _delay_ms(FLASH_DELAY);       // wait
+      wait_cycles(FLASH_DELAY);     // wait
       r = 0;                        // flash off
       g = 0;
       b = 0;                       
       power = 0;                    // reset power
+      if (since_other < 0xffff - FLASH_DELAY) {
+        since_other += FLASH_DELAY;
+      }
       blind = BLIND_AFTER_SELF;     // blind after our own flash for some cycles
       if (nervous > 3) {            // decrease the nervous level
 	nervous -= 3;